@@ -0,0 +1,327 @@
+/*
+ *   Copyright 2017 Thomas d'Otreppe de Bouvette <tdotreppe@aircrack-ng.org>
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+
+ *       http://www.apache.org/licenses/LICENSE-2.0
+
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#ifndef BEAT_PROTOCOL_ADMISSION_H
+#define BEAT_PROTOCOL_ADMISSION_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <algorithm>
+#include <Poco/Timestamp.h>
+#include "elastic.h"
+
+using std::string;
+using std::vector;
+using std::deque;
+
+#define _ESB_DEFAULT_MAX_QUEUE_DEPTH 100000
+#define _ESB_DEFAULT_MAX_BULK_LATENCY_MS 5000
+#define _ESB_DEFAULT_MAX_429_RATE 0.1
+#define _ESB_DEFAULT_SAMPLE_EVERY 10
+#define _ESB_EWMA_ALPHA 0.2
+
+namespace beat {
+	namespace protocols {
+
+		// Lower value is more important. Critical is never shed nor rate limited.
+		enum Priority {
+			Critical,
+			High,
+			Normal,
+			Low,
+			PriorityCount
+		};
+
+		enum SheddingPolicy {
+			DropLowestFirst,	// Shed classes entirely, starting with the lowest priority
+			Sampling			// Keep one document out of N in the shed classes
+		};
+
+		struct AdmissionStats {
+			unsigned long long admitted[PriorityCount];
+			unsigned long long shed[PriorityCount];
+			unsigned long long failed[PriorityCount];	// Invalid or refused by Elasticsearch, not retried
+			unsigned long long requeued[PriorityCount];	// Put back in the queue after 0, timeout, 429 or 503
+			unsigned long long sent;
+			AdmissionStats() : sent(0)
+			{
+				std::fill(admitted, admitted + PriorityCount, 0ULL);
+				std::fill(shed, shed + PriorityCount, 0ULL);
+				std::fill(failed, failed + PriorityCount, 0ULL);
+				std::fill(requeued, requeued + PriorityCount, 0ULL);
+			}
+		};
+
+		// Admission stage in front of bulkRequest(): per-priority queues, token bucket
+		// rate limit and load shedding when the queue, bulk latency or 429 rate says
+		// the cluster is falling behind.
+		// push() can be called from any thread, flush() from a single sender thread.
+		class admission
+		{
+			private:
+				elastic & _elastic;
+				string _indexBasename;
+				IndexType _indexType;
+
+				std::mutex _lock;
+				deque <string> _queues[PriorityCount];
+				size_t _queued;
+
+				// Token bucket (documents)
+				double _rate;
+				double _burst;
+				double _tokens;
+				Poco::Timestamp _lastRefill;
+
+				// Shedding
+				SheddingPolicy _policy;
+				unsigned int _sampleEvery;
+				unsigned long long _sampleCounters[PriorityCount];
+				unsigned int _shedLevel; // Amount of lowest priority classes currently shed
+				size_t _maxQueueDepth;
+				double _maxLatencyMs;
+				double _max429Rate;
+				double _latencyMs;
+				double _429Rate;
+
+				AdmissionStats _stats;
+
+				void refill()
+				{
+					Poco::Timestamp now;
+					double elapsed = static_cast<double>(now - this->_lastRefill) / Poco::Timestamp::resolution();
+					this->_lastRefill = now;
+					this->_tokens = std::min(this->_burst, this->_tokens + elapsed * this->_rate);
+				}
+
+				inline bool isShed(Priority priority)
+				{
+					return priority != Critical && static_cast<unsigned int>(priority) + this->_shedLevel >= PriorityCount;
+				}
+
+				// Drops the oldest document of the lowest priority class below 'priority'
+				bool evictLowerThan(Priority priority)
+				{
+					for (int p = PriorityCount - 1; p > priority; --p) {
+						if (!this->_queues[p].empty()) {
+							this->_queues[p].pop_front();
+							--this->_queued;
+							++this->_stats.shed[p];
+							return true;
+						}
+					}
+					return false;
+				}
+
+				// Worth sending again later: the cluster is busy or could not be reached
+				static inline bool isTransient(unsigned short status)
+				{
+					return status == 0 || status == _ESB_STATUS_TIMEOUT || status == 429 || status == 503;
+				}
+
+				// 'rejected429' is the fraction of the documents refused with a 429,
+				// for the whole request or per item
+				void updateShedLevel(double rejected429, double latencyMs)
+				{
+					this->_latencyMs += _ESB_EWMA_ALPHA * (latencyMs - this->_latencyMs);
+					this->_429Rate += _ESB_EWMA_ALPHA * (rejected429 - this->_429Rate);
+
+					bool overloaded = this->_queued >= this->_maxQueueDepth
+						|| this->_latencyMs > this->_maxLatencyMs
+						|| this->_429Rate > this->_max429Rate;
+
+					// Shed one more class per flush while overloaded, recover one class at a time
+					if (overloaded) {
+						if (this->_shedLevel < PriorityCount - 1) {
+							++this->_shedLevel;
+						}
+					} else if (this->_shedLevel > 0) {
+						--this->_shedLevel;
+					}
+				}
+
+			public:
+				admission(elastic & e, const string & indexBasename, IndexType indexType = Daily) :
+					_elastic(e), _indexBasename(indexBasename), _indexType(indexType), _queued(0),
+					_rate(0), _burst(0), _tokens(0),
+					_policy(DropLowestFirst), _sampleEvery(_ESB_DEFAULT_SAMPLE_EVERY), _shedLevel(0),
+					_maxQueueDepth(_ESB_DEFAULT_MAX_QUEUE_DEPTH), _maxLatencyMs(_ESB_DEFAULT_MAX_BULK_LATENCY_MS),
+					_max429Rate(_ESB_DEFAULT_MAX_429_RATE), _latencyMs(0), _429Rate(0)
+				{
+					if (indexBasename.empty()) {
+						throw string("Admission: index basename is required");
+					}
+					std::fill(this->_sampleCounters, this->_sampleCounters + PriorityCount, 0ULL);
+				}
+
+				// Documents per second sent to Elasticsearch (Critical excluded). 0 means unlimited.
+				void setRateLimit(double docsPerSecond, unsigned int burst)
+				{
+					std::lock_guard<std::mutex> guard(this->_lock);
+					this->_rate = docsPerSecond;
+					this->_burst = burst;
+					this->_tokens = burst;
+					this->_lastRefill.update();
+				}
+
+				void setSheddingPolicy(SheddingPolicy policy, unsigned int sampleEvery = _ESB_DEFAULT_SAMPLE_EVERY)
+				{
+					std::lock_guard<std::mutex> guard(this->_lock);
+					this->_policy = policy;
+					this->_sampleEvery = std::max(1U, sampleEvery);
+				}
+
+				void setOverloadThresholds(size_t maxQueueDepth, unsigned int maxLatencyMs, double max429Rate)
+				{
+					std::lock_guard<std::mutex> guard(this->_lock);
+					this->_maxQueueDepth = maxQueueDepth;
+					this->_maxLatencyMs = maxLatencyMs;
+					this->_max429Rate = max429Rate;
+				}
+
+				// Returns false if the document was shed
+				bool push(const string & doc, Priority priority = Normal)
+				{
+					std::lock_guard<std::mutex> guard(this->_lock);
+
+					bool admit = true;
+					if (this->isShed(priority)) {
+						admit = (this->_policy == Sampling && this->_sampleCounters[priority]++ % this->_sampleEvery == 0);
+					}
+
+					// Queue full: make room at the expense of less important documents
+					if (admit && priority != Critical && this->_queued >= this->_maxQueueDepth) {
+						admit = this->evictLowerThan(priority);
+					}
+
+					if (!admit) {
+						++this->_stats.shed[priority];
+						return false;
+					}
+
+					this->_queues[priority].push_back(doc);
+					++this->_queued;
+					++this->_stats.admitted[priority];
+					return true;
+				}
+
+				// Sends up to maxDocs documents, most important first. Critical documents
+				// ignore the rate limit. Documents that got a connection error, a timeout,
+				// a 429 or a 503 (whole request or per item) are queued again, as well as
+				// all of them while not connected. Returns NULL if nothing was sent.
+				BulkResponse * flush(size_t maxDocs)
+				{
+					vector <string> docs;
+					vector <Priority> priorities;
+					{
+						std::lock_guard<std::mutex> guard(this->_lock);
+
+						size_t budget = maxDocs;
+						if (this->_rate > 0) {
+							this->refill();
+							budget = std::min(budget, static_cast<size_t>(std::max(0.0, this->_tokens)));
+						}
+
+						for (int p = Critical; p < PriorityCount && docs.size() < maxDocs; ++p) {
+							deque <string> & queue = this->_queues[p];
+							while (!queue.empty() && docs.size() < maxDocs && (p == Critical || budget > 0)) {
+								docs.push_back(std::move(queue.front()));
+								priorities.push_back(static_cast<Priority>(p));
+								queue.pop_front();
+								--this->_queued;
+								if (p != Critical) {
+									--budget;
+									this->_tokens -= 1;
+								}
+							}
+						}
+					}
+
+					if (docs.empty()) {
+						return NULL;
+					}
+
+					Poco::Timestamp start;
+					BulkResponse * ret = this->_elastic.bulkRequest(docs, this->_indexBasename, this->_indexType);
+					double latencyMs = static_cast<double>(start.elapsed()) / 1000;
+
+					std::lock_guard<std::mutex> guard(this->_lock);
+					unsigned short httpStatus = (ret) ? ret->httpStatus : 0;
+
+					// Invalid documents would fail again
+					vector <bool> invalid(docs.size(), false);
+					if (ret) {
+						for (unsigned int pos : ret->rejected) {
+							invalid[pos] = true;
+						}
+					}
+
+					// Status of each document: the whole request failed, or per item
+					size_t rejected429 = 0;
+					vector <bool> retry(docs.size(), false);
+					for (size_t i = 0; i < docs.size(); ++i) {
+						if (invalid[i]) {
+							++this->_stats.failed[priorities[i]];
+							continue;
+						}
+						// NULL means not connected (the basename is checked in the constructor), same as a connection error
+						unsigned short status = (ret == NULL) ? 0 : (httpStatus == 200) ? ret->itemStatus[i] : httpStatus;
+						if (status == 429) {
+							++rejected429;
+						}
+						if (status >= 200 && status < 300) {
+							++this->_stats.sent;
+						} else if (httpStatus == 200 && status == 0) {
+							// Not reported by the server, cannot tell
+							++this->_stats.failed[priorities[i]];
+						} else if (isTransient(status)) {
+							retry[i] = true;
+						} else {
+							++this->_stats.failed[priorities[i]];
+						}
+					}
+
+					// Put them back where they were
+					for (size_t i = docs.size(); i > 0; --i) {
+						if (retry[i - 1]) {
+							this->_queues[priorities[i - 1]].push_front(std::move(docs[i - 1]));
+							++this->_queued;
+							++this->_stats.requeued[priorities[i - 1]];
+						}
+					}
+					this->updateShedLevel(static_cast<double>(rejected429) / docs.size(), latencyMs);
+
+					return ret;
+				}
+
+				inline size_t queued()
+				{
+					std::lock_guard<std::mutex> guard(this->_lock);
+					return this->_queued;
+				}
+
+				inline AdmissionStats getStats()
+				{
+					std::lock_guard<std::mutex> guard(this->_lock);
+					return this->_stats;
+				}
+		};
+	}
+}
+
+#endif // BEAT_PROTOCOL_ADMISSION_H
@@ -0,0 +1,381 @@
+/*
+ *   Copyright 2017 Thomas d'Otreppe de Bouvette <tdotreppe@aircrack-ng.org>
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+
+ *       http://www.apache.org/licenses/LICENSE-2.0
+
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#ifndef BEAT_PROTOCOL_AGGREGATOR_H
+#define BEAT_PROTOCOL_AGGREGATOR_H
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <rapidjson/document.h>
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
+#include <Poco/Timestamp.h>
+
+using std::string;
+using std::vector;
+using std::stringstream;
+using namespace rapidjson;
+
+#define _ESB_AGGREGATOR_INITIAL_CAPACITY 1024
+#define _ESB_AGGREGATOR_EMPTY_SLOT 0xFFFFFFFF
+
+namespace beat {
+	namespace protocols {
+
+		// Collapses near-duplicate documents (same values for the key fields) within a
+		// tumbling time window into one rollup document, before they go to bulkRequest().
+		// The rollup is the first document of the group with an extra "rollup" object:
+		// {"rollup":{"count":12,"first":"<@timestamp>","last":"<@timestamp>","signal":{"min":-80,"max":-42,"sum":-700}}}
+		// Groups of a single document are emitted unchanged.
+		// Not thread-safe: use one instance per capture thread.
+		class aggregator
+		{
+			private:
+				struct NumericStat {
+					bool present;
+					double min;
+					double max;
+					double sum;
+					NumericStat() : present(false), min(0), max(0), sum(0) { }
+				};
+
+				struct Group {
+					uint64_t hash;
+					string key;
+					string document;
+					string first;
+					string last;
+					unsigned long long count;
+					vector <NumericStat> stats;
+				};
+
+				// Open addressing, linear probing. Slots only hold the hash and the position
+				// of the group so probing stays within a few cache lines.
+				struct Slot {
+					uint64_t hash;
+					uint32_t group;
+				};
+
+				// Name as given and its dotted path, split once
+				struct Field {
+					string name;
+					vector <string> path;
+				};
+
+				vector <Field> _keyFields;
+				vector <Field> _numericFields;
+				Field _timestamp;
+				Poco::Timestamp::TimeDiff _window;
+				Poco::Timestamp _windowStart;
+
+				vector <Slot> _slots;
+				size_t _mask;
+				vector <Group> _groups;
+
+				static Field makeField(const string & name)
+				{
+					Field ret;
+					ret.name = name;
+					stringstream ss(name);
+					string item;
+					while (std::getline(ss, item, '.')) {
+						ret.path.push_back(item);
+					}
+					return ret;
+				}
+
+				// Literal key first (flattened documents, ie "wlan.bssid":"..."),
+				// then dotted path lookup ({"wlan":{"bssid":"..."}})
+				static const Value * getField(const Value & d, const Field & field)
+				{
+					if (!d.IsObject()) {
+						return NULL;
+					}
+					Value::ConstMemberIterator it = d.FindMember(field.name.c_str());
+					if (it != d.MemberEnd()) {
+						return &it->value;
+					}
+					if (field.path.size() < 2) {
+						return NULL;
+					}
+
+					const Value * v = &d;
+					for (const string & name : field.path) {
+						if (!v->IsObject()) {
+							return NULL;
+						}
+						it = v->FindMember(name.c_str());
+						if (it == v->MemberEnd()) {
+							return NULL;
+						}
+						v = &it->value;
+					}
+					return v;
+				}
+
+				// Type, length and value, so that "true" and true, or values containing
+				// what could be a separator, never end up in the same group
+				static void appendKeyPart(string & key, char type, const char * value, size_t len)
+				{
+					key += type;
+					key += std::to_string(len);
+					key += ':';
+					key.append(value, len);
+				}
+
+				static void appendKeyPart(string & key, const Value & v)
+				{
+					if (v.IsString()) {
+						appendKeyPart(key, 's', v.GetString(), v.GetStringLength());
+					} else if (v.IsBool()) {
+						appendKeyPart(key, 'b', v.GetBool() ? "true" : "false", v.GetBool() ? 4 : 5);
+					} else if (v.IsNull()) {
+						appendKeyPart(key, 'z', "", 0);
+					} else if (v.IsUint64()) {
+						string value(std::to_string(v.GetUint64()));
+						appendKeyPart(key, 'n', value.data(), value.size());
+					} else if (v.IsInt64()) {
+						string value(std::to_string(v.GetInt64()));
+						appendKeyPart(key, 'n', value.data(), value.size());
+					} else if (v.IsNumber()) {
+						// flawfinder: ignore
+						char number[32];
+						int len = snprintf(number, sizeof(number), "%.17g", v.GetDouble());
+						appendKeyPart(key, 'n', number, static_cast<size_t>(len));
+					} else {
+						// Object or array
+						StringBuffer buffer;
+						Writer<StringBuffer> writer(buffer);
+						v.Accept(writer);
+						appendKeyPart(key, 'j', buffer.GetString(), buffer.GetSize());
+					}
+				}
+
+				static inline uint64_t hash(const string & key)
+				{
+					// FNV-1a
+					uint64_t h = 14695981039346656037ULL;
+					for (unsigned char c : key) {
+						h ^= c;
+						h *= 1099511628211ULL;
+					}
+					return h;
+				}
+
+				void resetTable(size_t capacity)
+				{
+					Slot empty;
+					empty.hash = 0;
+					empty.group = _ESB_AGGREGATOR_EMPTY_SLOT;
+					this->_slots.assign(capacity, empty);
+					this->_mask = capacity - 1;
+				}
+
+				void insertSlot(uint64_t h, uint32_t group)
+				{
+					size_t pos = h & this->_mask;
+					while (this->_slots[pos].group != _ESB_AGGREGATOR_EMPTY_SLOT) {
+						pos = (pos + 1) & this->_mask;
+					}
+					this->_slots[pos].hash = h;
+					this->_slots[pos].group = group;
+				}
+
+				// Keep load factor under 50%
+				void grow()
+				{
+					this->resetTable(this->_slots.size() * 2);
+					for (size_t i = 0; i < this->_groups.size(); ++i) {
+						this->insertSlot(this->_groups[i].hash, static_cast<uint32_t>(i));
+					}
+				}
+
+				Group * findOrInsert(const string & key, bool & inserted)
+				{
+					uint64_t h = hash(key);
+					size_t pos = h & this->_mask;
+					while (this->_slots[pos].group != _ESB_AGGREGATOR_EMPTY_SLOT) {
+						const Slot & slot = this->_slots[pos];
+						if (slot.hash == h && this->_groups[slot.group].key == key) {
+							inserted = false;
+							return &this->_groups[slot.group];
+						}
+						pos = (pos + 1) & this->_mask;
+					}
+
+					inserted = true;
+					this->_slots[pos].hash = h;
+					this->_slots[pos].group = static_cast<uint32_t>(this->_groups.size());
+					this->_groups.push_back(Group());
+					Group * ret = &this->_groups.back();
+					ret->hash = h;
+					ret->key = key;
+					ret->count = 0;
+					ret->stats.resize(this->_numericFields.size());
+
+					if (this->_groups.size() * 2 > this->_slots.size()) {
+						this->grow();
+						ret = &this->_groups.back();
+					}
+					return ret;
+				}
+
+				string getRollup(const Group & g)
+				{
+					StringBuffer buffer;
+					Writer<StringBuffer> writer(buffer);
+					writer.StartObject();
+					writer.Key("count");
+					writer.Uint64(g.count);
+					writer.Key("first");
+					writer.String(g.first.data(), static_cast<SizeType>(g.first.size()));
+					writer.Key("last");
+					writer.String(g.last.data(), static_cast<SizeType>(g.last.size()));
+					for (size_t i = 0; i < g.stats.size(); ++i) {
+						if (!g.stats[i].present) {
+							continue;
+						}
+						const string & name = this->_numericFields[i].name;
+						writer.Key(name.data(), static_cast<SizeType>(name.size()));
+						writer.StartObject();
+						writer.Key("min");
+						writer.Double(g.stats[i].min);
+						writer.Key("max");
+						writer.Double(g.stats[i].max);
+						writer.Key("sum");
+						writer.Double(g.stats[i].sum);
+						writer.EndObject();
+					}
+					writer.EndObject();
+					string rollup("\"rollup\":");
+					rollup.append(buffer.GetString(), buffer.GetSize());
+
+					// Add it to the first document of the group (it is a valid object)
+					string ret(g.document);
+					size_t end = ret.find_last_of('}');
+					size_t prev = ret.find_last_not_of(" \t\r\n", end - 1);
+					ret.insert(end, (ret[prev] == '{') ? rollup : "," + rollup);
+					return ret;
+				}
+
+			public:
+				aggregator(const vector <string> & keyFields, const vector <string> & numericFields, unsigned int windowMs) :
+					_window(Poco::Timestamp::TimeDiff(windowMs) * 1000), _mask(0)
+				{
+					if (keyFields.empty()) {
+						throw string("Aggregator: at least one key field is required");
+					}
+					for (const string & field : keyFields) {
+						this->_keyFields.push_back(makeField(field));
+					}
+					for (const string & field : numericFields) {
+						this->_numericFields.push_back(makeField(field));
+					}
+					this->_timestamp = makeField("@timestamp");
+					this->resetTable(_ESB_AGGREGATOR_INITIAL_CAPACITY);
+				}
+
+				// Adds a document to its group. Documents that cannot be parsed, lack a
+				// key field or already have a top-level "rollup" key (it would be
+				// duplicated) are passed through to 'out' as they are.
+				// Rollups of the previous window are appended to 'out' when it closes.
+				void add(const string & doc, vector <string> & out)
+				{
+					this->poll(out);
+
+					Document d;
+					d.Parse(doc.c_str());
+					if (d.HasParseError() || !d.IsObject() || d.HasMember("rollup")) {
+						out.push_back(doc);
+						return;
+					}
+
+					// Build key
+					string key;
+					for (const Field & field : this->_keyFields) {
+						const Value * v = getField(d, field);
+						if (v == NULL) {
+							out.push_back(doc);
+							return;
+						}
+						appendKeyPart(key, *v);
+					}
+
+					bool inserted;
+					Group * g = this->findOrInsert(key, inserted);
+					const Value * ts = getField(d, this->_timestamp);
+					string timestamp;
+					if (ts != NULL && ts->IsString()) {
+						timestamp.assign(ts->GetString(), ts->GetStringLength());
+					}
+					if (inserted) {
+						g->document = doc;
+						g->first = timestamp;
+					}
+					g->last = timestamp;
+					++g->count;
+
+					for (size_t i = 0; i < this->_numericFields.size(); ++i) {
+						const Value * v = getField(d, this->_numericFields[i]);
+						if (v == NULL || !v->IsNumber()) {
+							continue;
+						}
+						double value = v->GetDouble();
+						NumericStat & stat = g->stats[i];
+						if (!stat.present) {
+							stat.present = true;
+							stat.min = stat.max = stat.sum = value;
+						} else {
+							stat.min = std::min(stat.min, value);
+							stat.max = std::max(stat.max, value);
+							stat.sum += value;
+						}
+					}
+				}
+
+				// Closes the current window: appends all the rollups to 'out'
+				void flush(vector <string> & out)
+				{
+					for (const Group & g : this->_groups) {
+						out.push_back((g.count == 1) ? g.document : this->getRollup(g));
+					}
+
+					this->_groups.clear();
+					this->resetTable(this->_slots.size());
+					this->_windowStart.update();
+				}
+
+				// Closes the window if it expired, call it periodically when traffic is low
+				inline void poll(vector <string> & out)
+				{
+					if (this->_windowStart.elapsed() >= this->_window) {
+						this->flush(out);
+					}
+				}
+
+				inline size_t pending()
+				{
+					return this->_groups.size();
+				}
+		};
+	}
+}
+
+#endif // BEAT_PROTOCOL_AGGREGATOR_H
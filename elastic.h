@@ -25,13 +25,24 @@
 #include <Poco/Net/HTTPClientSession.h>
 #include <Poco/Net/HTTPRequest.h>
 #include <Poco/Net/HTTPResponse.h>
+#include <Poco/Net/StreamSocket.h>
 #include <Poco/InflatingStream.h>
 #include <Poco/URI.h>
-//#include <Poco/Timespan.h>
+#include <Poco/Timespan.h>
+#include <Poco/Timestamp.h>
+#include <Poco/Exception.h>
 #include <istream>
 #include <sstream>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <algorithm>
 #include <time.h>
+#include <stdio.h>
 #include "utils.h"
+#include "validator.h"
 
 using std::string;
 using std::vector;
@@ -43,6 +54,19 @@ using namespace rapidjson;
 #define _ESB_USER_AGENT "elasticbeat-cpp/0.1"
 #define _CONTENT_TYPE_JSON "application/json; charset=UTF-8"
 
+// Returned by doRequest() when the deadline expired before the server answered.
+// Not an HTTP status, same as 0 for connection errors.
+#define _ESB_STATUS_TIMEOUT 1
+#define _ESB_IO_CHUNK_SIZE 65536
+#define _ESB_DEFAULT_TIMEOUT_MS 30000
+#define _ESB_RETRY_BACKOFF_MS 100
+#define _ESB_HEDGE_DEFAULT_DELAY_MS 50
+#define _ESB_LATENCY_SAMPLES 128
+#define _ESB_LATENCY_MIN_SAMPLES 20
+
+// Rollover daily or at 50GB, whichever comes first
+#define _ESB_DEFAULT_ILM_POLICY "{\"policy\":{\"phases\":{\"hot\":{\"actions\":{\"rollover\":{\"max_age\":\"1d\",\"max_size\":\"50gb\"}}}}}}"
+
 
 namespace beat {
 	namespace protocols {
@@ -50,16 +74,28 @@ namespace beat {
 		struct BulkResponse {
 			unsigned short int httpStatus;
 			bool errors;
+			bool timedOut;
 			string error;
 			vector <string> IDs;
-			BulkResponse() : httpStatus(0), errors(true), error(""), IDs(vector <string>()) { }
+			vector <unsigned int> rejected; // Position in 'docs' of the documents that failed validation
+			vector <string> quarantine;
+			vector <unsigned short> itemStatus; // Status of each document, same position as in 'docs'. 0 if not sent or not reported
+			BulkResponse() : httpStatus(0), errors(true), timedOut(false), error(""), IDs(vector <string>()) { }
 		};
 
 		enum IndexType {
 			Daily,
 			Monthly,
 			Yearly,
-			NoTime
+			NoTime,
+			DataStream,	// Name is a data stream, server handles rollover (ES 7.9+)
+			WriteAlias	// Name is an ILM write alias, server handles rollover (ES 6.6+)
+		};
+
+		enum ValidationMode {
+			NoValidation,	// Documents are sent as they are
+			Reject,			// Invalid documents are dropped from the request
+			Quarantine		// Same as Reject and a copy is kept in the response
 		};
 
 		enum HTTPVerb {
@@ -79,16 +115,127 @@ namespace beat {
 				string _bulkURL;
 				string _indicesURL;
 
-				static unsigned short doRequest(const string & URL, const HTTPVerb verb, Document & response, const string & data = "", const string & contentType = "")
+				Poco::Timespan _timeout;
+				unsigned int _retries;
+				bool _hedging;
+				Poco::Timespan _hedgeDelay;
+				vector <Poco::Timestamp::TimeDiff> _latencies;
+				size_t _latencyPos;
+				ValidationMode _validation;
+
+				// Shared between the caller and the attempts of a hedged request.
+				// Attempts run detached so the loser never blocks the caller.
+				struct HedgeState {
+					std::mutex lock;
+					std::condition_variable cv;
+					bool done;
+					unsigned int pending;
+					unsigned short status;
+					Document response;
+					Poco::Timestamp start;
+					Poco::Timestamp::TimeDiff primaryLatency; // -1 until the first attempt completes
+					HedgeState() : done(false), pending(0), status(0), primaryLatency(-1) { }
+				};
+
+				// Shuts the socket down when the deadline passes. Poco reads the status
+				// line and headers with as many reads as it needs, this bounds them too.
+				struct DeadlineWatchdog {
+					std::mutex lock;
+					std::condition_variable cv;
+					bool done;
+					std::thread thread;
+				
+					DeadlineWatchdog(Poco::Net::HTTPClientSession & session, const Poco::Timestamp & deadline) : done(false)
+					{
+						std::chrono::steady_clock::time_point until = std::chrono::steady_clock::now() + std::chrono::microseconds(deadline - Poco::Timestamp());
+						this->thread = std::thread([this, &session, until]() {
+							std::unique_lock<std::mutex> guard(this->lock);
+							if (!this->cv.wait_until(guard, until, [this]() { return this->done; })) {
+								try {
+									// Pending and future reads/writes fail right away
+									session.socket().shutdown();
+								} catch (...) {
+									// Not connected yet, connect has its own timeout
+								}
+							}
+						});
+					}
+				
+					~DeadlineWatchdog()
+					{
+						{
+							std::lock_guard<std::mutex> guard(this->lock);
+							this->done = true;
+						}
+						this->cv.notify_one();
+						this->thread.join();
+					}
+				};
+				
+				// Applies what is left of the deadline to the next socket operation.
+				// Returns false if the deadline already passed.
+				static bool setSocketTimeout(Poco::Net::HTTPClientSession & session, const Poco::Timestamp & deadline)
+				{
+					Poco::Timestamp::TimeDiff remaining = deadline - Poco::Timestamp();
+					if (remaining <= 0) {
+						return false;
+					}
+					session.socket().setSendTimeout(Poco::Timespan(remaining));
+					session.socket().setReceiveTimeout(Poco::Timespan(remaining));
+					return true;
+				}
+
+				static bool writeBody(std::ostream & os, Poco::Net::HTTPClientSession & session, const string & data, const Poco::Timestamp & deadline)
+				{
+					for (size_t pos = 0; pos < data.size(); pos += _ESB_IO_CHUNK_SIZE) {
+						if (!setSocketTimeout(session, deadline)) {
+							return false;
+						}
+						os.write(data.data() + pos, std::min(data.size() - pos, static_cast<size_t>(_ESB_IO_CHUNK_SIZE)));
+						os.flush();
+						if (!os.good()) {
+							return false;
+						}
+					}
+					return true;
+				}
+
+				// Same as utils::istream2string() but a slow server cannot keep it past the deadline
+				static bool readBody(istream & is, Poco::Net::HTTPClientSession & session, const Poco::Timestamp & deadline, string & ret)
+				{
+					// flawfinder: ignore
+					char buffer[_EB_UTILS_BUFFER_LEN];
+					std::streambuf * sb = is.rdbuf();
+					while (setSocketTimeout(session, deadline)) {
+						// sgetc() does at most one socket read, the deadline is checked before each one
+						if (sb->sgetc() == std::char_traits<char>::eof()) {
+							return true;
+						}
+						std::streamsize len = std::min(sb->in_avail(), static_cast<std::streamsize>(sizeof(buffer)));
+						ret.append(buffer, sb->sgetn(buffer, len));
+					}
+					return false;
+				}
+
+				static unsigned short doRequest(const string & URL, const HTTPVerb verb, Document & response, const Poco::Timestamp & deadline, const string & data = "", const string & contentType = "")
 				{
 					bool send_body = false;
 					Poco::URI uri(URL);
 
+					// Whatever is left of the deadline is recomputed before connect, send and each body read.
+					// The watchdog covers the rest (response headers).
+					Poco::Timestamp::TimeDiff remaining = deadline - Poco::Timestamp();
+					if (remaining <= 0) {
+						return _ESB_STATUS_TIMEOUT;
+					}
+
 					// Memory leak: https://stackoverflow.com/questions/6375411/linking-poco-c-library-gives-numerous-memory-leaks
 					Poco::Net::HTTPClientSession session(uri.getHost(), uri.getPort());
 					session.setKeepAlive(false);
 					//session.setKeepAlive(true);
 					//session.setKeepAliveTimeout(Poco::Timespan(60, 0));
+					session.setTimeout(Poco::Timespan(remaining));
+					DeadlineWatchdog watchdog(session, deadline);
 					string path(uri.getPathAndQuery());
 					
 					// Prepare request
@@ -108,20 +255,22 @@ namespace beat {
 
 					// Send request
 					try {
-						session.sendRequest(req);
-
-						// Get data
 						std::ostream& os = session.sendRequest(req);
-						if (send_body) {
-							os << data;  // sends the body
+						if (send_body && !writeBody(os, session, data, deadline)) {
+							return (Poco::Timestamp() < deadline) ? 0 : _ESB_STATUS_TIMEOUT;
 						}
 
 						// TODO: Support gzipped output from ES (use zlib if necessary)
 						//       https://pocoproject.org/slides/100-Streams.pdf
+						if (!setSocketTimeout(session, deadline)) {
+							return _ESB_STATUS_TIMEOUT;
+						}
 						Poco::Net::HTTPResponse res;
 						istream &is = session.receiveResponse(res);
 						string responseStr = "";
-						beat::utils::istream2string(is, responseStr);
+						if (!readBody(is, session, deadline, responseStr)) {
+							return _ESB_STATUS_TIMEOUT;
+						}
 
 						// If there is any data, parse it
 						if (responseStr.empty() == false) {
@@ -130,12 +279,145 @@ namespace beat {
 						}
 
 						return res.getStatus();
+					} catch (Poco::TimeoutException &) {
+						return _ESB_STATUS_TIMEOUT;
 					} catch (...) {
-						return 0;
+						return (Poco::Timestamp() < deadline) ? 0 : _ESB_STATUS_TIMEOUT;
 					}
 				}
 
+				static void doHedgedAttempt(std::shared_ptr<HedgeState> state, const string URL, const HTTPVerb verb, const Poco::Timestamp deadline, bool primary)
+				{
+					Document d;
+					unsigned short status = doRequest(URL, verb, d, deadline);
+
+					std::lock_guard<std::mutex> guard(state->lock);
+					if (primary) {
+						state->primaryLatency = state->start.elapsed();
+					}
+					--state->pending;
+					if (state->done) {
+						return;
+					}
+
+					// First real answer wins. A failure only counts once nothing else is in flight.
+					if ((status != 0 && status != _ESB_STATUS_TIMEOUT) || state->pending == 0) {
+						state->done = true;
+						state->status = status;
+						state->response.Swap(d);
+						state->cv.notify_all();
+					}
+				}
+
+				// Only for idempotent requests (no body): a duplicate is sent on a new
+				// connection if the first one did not answer within the hedge delay.
+				// 'latency' is the one of the first attempt, not the winner, so the p95
+				// isn't pulled down by the hedges. If it is still running, it is at least
+				// the time waited so far.
+				unsigned short doHedgedRequest(const string & URL, const HTTPVerb verb, Document & response, const Poco::Timestamp & deadline, Poco::Timestamp::TimeDiff & latency)
+				{
+					std::shared_ptr<HedgeState> state = std::make_shared<HedgeState>();
+					std::unique_lock<std::mutex> lk(state->lock);
 
+					state->pending = 1;
+					std::thread(doHedgedAttempt, state, URL, verb, deadline, true).detach();
+
+					Poco::Timestamp::TimeDiff delay = std::min(this->getHedgeDelay().totalMicroseconds(), deadline - Poco::Timestamp());
+					if (delay > 0 && !state->cv.wait_for(lk, std::chrono::microseconds(delay), [&state] { return state->done; })) {
+						++state->pending;
+						std::thread(doHedgedAttempt, state, URL, verb, deadline, false).detach();
+					}
+
+					Poco::Timestamp::TimeDiff remaining = deadline - Poco::Timestamp();
+					if (remaining <= 0 || !state->cv.wait_for(lk, std::chrono::microseconds(remaining), [&state] { return state->done; })) {
+						return _ESB_STATUS_TIMEOUT;
+					}
+
+					latency = (state->primaryLatency >= 0) ? state->primaryLatency : state->start.elapsed();
+					response.Swap(state->response);
+					return state->status;
+				}
+
+				static bool isRetryable(unsigned short httpStatus, bool idempotent)
+				{
+					// 408, 429 and 503 mean the server did not process the request, safe to send again.
+					// Anything else may have been (partially) applied, only retry if idempotent.
+					switch (httpStatus) {
+						case 408:
+						case 429:
+						case 503:
+							return true;
+						case 0:
+						case 502:
+						case 504:
+							return idempotent;
+						default:
+							return false;
+					}
+				}
+
+				void recordLatency(Poco::Timestamp::TimeDiff latency)
+				{
+					if (this->_latencies.size() < _ESB_LATENCY_SAMPLES) {
+						this->_latencies.push_back(latency);
+					} else {
+						this->_latencies[this->_latencyPos] = latency;
+					}
+					this->_latencyPos = (this->_latencyPos + 1) % _ESB_LATENCY_SAMPLES;
+				}
+
+				// p95 of the recent idempotent request latencies, or the configured delay
+				// until there are enough samples.
+				Poco::Timespan getHedgeDelay()
+				{
+					if (this->_latencies.size() < _ESB_LATENCY_MIN_SAMPLES) {
+						return this->_hedgeDelay;
+					}
+
+					vector <Poco::Timestamp::TimeDiff> sorted(this->_latencies);
+					vector <Poco::Timestamp::TimeDiff>::iterator p95 = sorted.begin() + (sorted.size() * 95) / 100;
+					std::nth_element(sorted.begin(), p95, sorted.end());
+					return Poco::Timespan(*p95);
+				}
+
+				// Single deadline for the whole operation, retries included
+				unsigned short request(const string & URL, const HTTPVerb verb, Document & response, const string & data = "", const string & contentType = "", bool idempotent = false)
+				{
+					Poco::Timestamp deadline = Poco::Timestamp() + this->_timeout.totalMicroseconds();
+					Poco::Timestamp::TimeDiff backoff = _ESB_RETRY_BACKOFF_MS * 1000;
+					unsigned short httpStatus = 0;
+
+					for (unsigned int attempt = 0; attempt <= this->_retries; ++attempt) {
+						Document attemptResponse;
+						Poco::Timestamp start;
+						Poco::Timestamp::TimeDiff latency;
+						if (idempotent && this->_hedging && data.empty()) {
+							httpStatus = this->doHedgedRequest(URL, verb, attemptResponse, deadline, latency);
+						} else {
+							httpStatus = doRequest(URL, verb, attemptResponse, deadline, data, contentType);
+							latency = start.elapsed();
+						}
+
+						if (!isRetryable(httpStatus, idempotent) || attempt == this->_retries) {
+							if (idempotent && httpStatus != 0 && httpStatus != _ESB_STATUS_TIMEOUT) {
+								this->recordLatency(latency);
+							}
+							response.Swap(attemptResponse);
+							break;
+						}
+
+						// Back off, but never past the deadline: report what the server said
+						Poco::Timestamp::TimeDiff remaining = deadline - Poco::Timestamp();
+						if (remaining <= backoff) {
+							response.Swap(attemptResponse);
+							break;
+						}
+						std::this_thread::sleep_for(std::chrono::microseconds(backoff));
+						backoff *= 2;
+					}
+
+					return httpStatus;
+				}
 
 				string buildURL(const string & path)
 				{
@@ -173,7 +455,16 @@ namespace beat {
 					if (d.IsObject() == false) {
 						return "";
 					}
-					const char * ts = d["@timestamp"].GetString();
+					return getIndexFromTimestamp(d["@timestamp"].GetString(), indexBasename, indexType);
+				}
+
+				static string getIndexFromTimestamp(const char * ts, const string & indexBasename, IndexType indexType = Daily)
+				{
+					// No time required in index name, return it as is
+					if (indexType == NoTime) {
+						return string(indexBasename);
+					}
+
 					// flawfinder: ignore
 					if (ts == NULL || strlen(ts) != 24 || !strchr(ts, 'T') || ts[23] != 'Z') {
 						// Should look like 2017-06-03T16:45:40.000Z
@@ -215,14 +506,73 @@ namespace beat {
 					return ss.str();
 				}
 
-				static string getServerVersion(const string & url)
+				string getBulkAction(const char * op, const string & index)
+				{
+					stringstream ss;
+					ss << "{\"" << op << "\":{\"_index\":\"" << index << "\"";
+
+					// Be careful about future breaking changes:
+					// https://www.elastic.co/blog/index-type-parent-child-join-now-future-in-elasticsearch
+					// 6.x still requires it (one type per index), 7.0 made it optional
+					if (!this->isVersionAtLeast(7, 0)) {
+						ss << ",\"_type\":\"doc\"";
+					}
+					ss << "}}\n";
+					return ss.str();
+				}
+
+				bool isVersionAtLeast(int major, int minor)
+				{
+					int serverMajor = 0, serverMinor = 0;
+					if (sscanf(this->_elasticSearchVersion.c_str(), "%d.%d", &serverMajor, &serverMinor) != 2) {
+						return false;
+					}
+					return serverMajor > major || (serverMajor == major && serverMinor >= minor);
+				}
+
+				bool putLifecyclePolicy(const string & name, const string & policy)
+				{
+					string url = this->buildURL("_ilm/policy/" + name);
+					Document response;
+					return this->request(url, HTTPVerb::PUT, response, policy.empty() ? _ESB_DEFAULT_ILM_POLICY : policy, _CONTENT_TYPE_JSON) == 200;
+				}
+
+				bool putIndexTemplate(const string & name, const string & pattern, const string & settings, bool dataStream)
+				{
+					// Composable templates are 7.8+, data streams are 7.9+ and require them
+					if (dataStream && !isVersionAtLeast(7, 9)) {
+						return false;
+					}
+
+					stringstream ss;
+					string url;
+					if (isVersionAtLeast(7, 8)) {
+						url = this->buildURL("_index_template/" + name);
+						ss << "{\"index_patterns\":[\"" << pattern << "\"],";
+						if (dataStream) {
+							ss << "\"data_stream\":{},";
+						}
+						ss << "\"priority\":200,\"template\":{\"settings\":" << settings << "}}";
+					} else {
+						url = this->buildURL("_template/" + name);
+						ss << "{\"index_patterns\":[\"" << pattern << "\"],\"order\":200,\"settings\":" << settings << "}";
+					}
+
+					Document response;
+					return this->request(url, HTTPVerb::PUT, response, ss.str(), _CONTENT_TYPE_JSON) == 200;
+				}
+
+				string getServerVersion(const string & url)
 				{
 					string ret = "";
 					Document d;
-					unsigned short httpStatus = doRequest(url, HTTPVerb::GET, d);
+					unsigned short httpStatus = this->request(url, HTTPVerb::GET, d, "", "", true);
 					if (httpStatus == 0) {
 						throw string("Error while querying server <" + url + "> or invalid JSON"); 
 					}
+					if (httpStatus == _ESB_STATUS_TIMEOUT) {
+						throw string("Timed out while querying server <" + url + ">");
+					}
 					if (httpStatus != 200) {
 						throw string("Server returned an error, HTTP " + std::to_string(httpStatus));
 					}
@@ -258,7 +608,9 @@ namespace beat {
 				}
 
 			public:
-				explicit elastic(const string & host) : _host(host), _elasticSearchVersion(""), _bulkURL(""), _indicesURL("")
+				explicit elastic(const string & host, unsigned int timeoutMs = _ESB_DEFAULT_TIMEOUT_MS) : _host(host), _elasticSearchVersion(""), _bulkURL(""), _indicesURL(""),
+					_timeout(Poco::Timespan::TimeDiff(timeoutMs) * 1000), _retries(0), _hedging(false),
+					_hedgeDelay(Poco::Timespan::TimeDiff(_ESB_HEDGE_DEFAULT_DELAY_MS) * 1000), _latencyPos(0), _validation(NoValidation)
 				{
 					if (this->_host.empty()) {
 						throw string("Elastic: Host cannot be empty");
@@ -282,6 +634,32 @@ namespace beat {
 					return this->_host;
 				}
 
+				// Deadline for a whole operation: connect, send, receive and retries
+				inline void setTimeout(unsigned int timeoutMs)
+				{
+					this->_timeout = Poco::Timespan(Poco::Timespan::TimeDiff(timeoutMs) * 1000);
+				}
+
+				// Additional attempts on 429/503 (and connection errors for idempotent requests)
+				inline void setRetries(unsigned int retries)
+				{
+					this->_retries = retries;
+				}
+
+				// Hedged requests for idempotent reads. The delay before sending the duplicate
+				// is the p95 of recent latencies, initialDelayMs is used until there are enough samples.
+				inline void setHedging(bool enable, unsigned int initialDelayMs = _ESB_HEDGE_DEFAULT_DELAY_MS)
+				{
+					this->_hedging = enable;
+					this->_hedgeDelay = Poco::Timespan(Poco::Timespan::TimeDiff(initialDelayMs) * 1000);
+				}
+
+				// Validate and minify documents before they are added to the bulk request
+				inline void setValidation(ValidationMode mode)
+				{
+					this->_validation = mode;
+				}
+
 				bool retryConnection()
 				{
 					// Test connection
@@ -329,7 +707,7 @@ namespace beat {
 					}
 
 					Document response;
-					if (doRequest(this->_indicesURL, HTTPVerb::GET, response) != 200) {
+					if (this->request(this->_indicesURL, HTTPVerb::GET, response, "", "", true) != 200) {
 						return ret;
 					}
 
@@ -357,7 +735,7 @@ namespace beat {
 
 					string url = this->buildURL(index);
 					Document d;
-					return doRequest(url, HTTPVerb::HEAD, d) == 200;
+					return this->request(url, HTTPVerb::HEAD, d, "", "", true) == 200;
 				}
 
 				bool createIndex(const string & index)
@@ -401,7 +779,61 @@ namespace beat {
 					Document response;
 
 					// Do request. We should check there is no error returned but the server should already do that with the status code
-					return doRequest(url, HTTPVerb::PUT, response, BASE_SETTINGS, _CONTENT_TYPE_JSON) == 200;
+					return this->request(url, HTTPVerb::PUT, response, BASE_SETTINGS, _CONTENT_TYPE_JSON) == 200;
+				}
+
+				bool bootstrapDataStream(const string & name, const string & policy = "")
+				{
+					/*
+					 * PUT _ilm/policy/wifibeat-policy
+					 * PUT _index_template/wifibeat-template
+					 * {"index_patterns":["wifibeat"],"data_stream":{},"priority":200,"template":{"settings":{"index.lifecycle.name":"wifibeat-policy"}}}
+					 *
+					 * The data stream itself is created by the first write. Everything is
+					 * overwritten if it already exists so it is safe to call at every start.
+					 */
+					if (!this->_validConnection || name.empty() || !isVersionAtLeast(7, 9)) {
+						return false;
+					}
+
+					string policyName = name + "-policy";
+					if (!this->putLifecyclePolicy(policyName, policy)) {
+						return false;
+					}
+					return this->putIndexTemplate(name + "-template", name, "{\"index.lifecycle.name\":\"" + policyName + "\"}", true);
+				}
+
+				bool bootstrapWriteAlias(const string & alias, const string & policy = "")
+				{
+					/*
+					 * PUT _ilm/policy/wifibeat-policy
+					 * PUT _index_template/wifibeat-template
+					 * {"index_patterns":["wifibeat-*"],"priority":200,"template":{"settings":{"index.lifecycle.name":"wifibeat-policy","index.lifecycle.rollover_alias":"wifibeat"}}}
+					 * PUT wifibeat-000001
+					 * {"aliases":{"wifibeat":{"is_write_index":true}}}
+					 */
+					if (!this->_validConnection || alias.empty()) {
+						return false;
+					}
+
+					string policyName = alias + "-policy";
+					if (!this->putLifecyclePolicy(policyName, policy)) {
+						return false;
+					}
+					if (!this->putIndexTemplate(alias + "-template", alias + "-*",
+							"{\"index.lifecycle.name\":\"" + policyName + "\",\"index.lifecycle.rollover_alias\":\"" + alias + "\"}", false)) {
+						return false;
+					}
+
+					// Alias already there, ILM took over
+					Document d;
+					if (this->request(this->buildURL("_alias/" + alias), HTTPVerb::HEAD, d, "", "", true) == 200) {
+						return true;
+					}
+
+					Document response;
+					return this->request(this->buildURL(alias + "-000001"), HTTPVerb::PUT, response,
+							"{\"aliases\":{\"" + alias + "\":{\"is_write_index\":true}}}", _CONTENT_TYPE_JSON) == 200;
 				}
 
 				BulkResponse * bulkRequest(vector<string> & docs, const string & indexBasename, IndexType indexType = Daily)
@@ -468,33 +900,89 @@ namespace beat {
 						ret->errors = false;
 						return ret;
 					}
+					ret->itemStatus.assign(docs.size(), 0);
+
+					// Data streams and write aliases have a single target and the server
+					// handles rollover: no per-document routing. Data streams only accept 'create'.
+					bool singleTarget = (indexType == DataStream || indexType == WriteAlias);
+					const char * op = (indexType == DataStream) ? "create" : "index";
+					string action;
+					if (singleTarget) {
+						action = this->getBulkAction(op, indexBasename);
+					}
 
-					// Get list of indices for the documents
-					vector <string> indices;
+					// Create the bulk request. Documents are minified straight into the body.
+					size_t bodySize = 0;
 					for (i = 0; i < docs.size(); ++i) {
-						indices.push_back(getIndexFromDocument(docs[i], indexBasename, indexType));
+						bodySize += docs[i].size() + 1;
 					}
-
-
-					// Create the bulk request
-					stringstream ss;
-					for (i = 0; i < indices.size(); ++i) {
-						// Add index name
-						ss << "{\"index\":{\"_index\":\""
-							<< indices[i] << "\"";
-
-						// Be careful about future breaking changes:
-						// https://www.elastic.co/blog/index-type-parent-child-join-now-future-in-elasticsearch
-						if (this->_elasticSearchVersion.empty() || this->_elasticSearchVersion[0] - '0' < 6 ) {
-							ss << ",\"_type\":\"doc\"";
+					string body, timestamp;
+					body.reserve(bodySize + docs.size() * (action.size() + 64));
+					vector <unsigned int> sent; // Position in 'docs' of each item of the request
+					sent.reserve(docs.size());
+					for (i = 0; i < docs.size(); ++i) {
+						size_t mark = body.size();
+						if (this->_validation == NoValidation) {
+							if (!singleTarget) {
+								action = this->getBulkAction(op, getIndexFromDocument(docs[i], indexBasename, indexType));
+							}
+							body += action;
+							body += docs[i];
+						} else {
+							if (singleTarget) {
+								body += action;
+							}
+							// Validation already found the timestamp, no need to parse it again.
+							// Without a usable one, there is no index to send it to.
+							string index;
+							if (validator::minify(docs[i], body, timestamp)) {
+								index = singleTarget ? indexBasename : getIndexFromTimestamp(timestamp.c_str(), indexBasename, indexType);
+							}
+							if (index.empty()) {
+								body.resize(mark);
+								ret->rejected.push_back(i);
+								if (this->_validation == Quarantine) {
+									ret->quarantine.push_back(docs[i]);
+								}
+								continue;
+							}
+							if (!singleTarget) {
+								body.insert(mark, this->getBulkAction(op, index));
+							}
 						}
-						ss << "}}\n" << docs[i] << '\n';
+						body += '\n';
+						sent.push_back(i);
+					}
+
+					if (sent.empty()) {
+						ret->error = "All documents failed validation";
+						return ret;
 					}
 
 					// Send all the data
 					Document response;
-					ret->httpStatus = doRequest(this->_bulkURL, HTTPVerb::POST, response, ss.str(), _CONTENT_TYPE_JSON);
+					ret->httpStatus = this->request(this->_bulkURL, HTTPVerb::POST, response, body, _CONTENT_TYPE_JSON);
 					ret->errors = (ret->httpStatus != 200 || response.IsObject() == false);
+					if (ret->httpStatus == _ESB_STATUS_TIMEOUT) {
+						ret->timedOut = true;
+						ret->error = "Bulk request timed out";
+						return ret;
+					}
+
+					// Items are in the same order as the request. Rejections (ie 429) are
+					// usually reported there, with a 200 for the whole request.
+					if (response.IsObject() && response.HasMember("items") && response["items"].IsArray()) {
+						const Value & items = response["items"];
+						for (SizeType item = 0; item < items.Size() && item < sent.size(); ++item) {
+							if (!items[item].IsObject() || !items[item].HasMember(op)) {
+								continue;
+							}
+							const Value & idx = items[item][op];
+							if (idx.IsObject() && idx.HasMember("status") && idx["status"].IsUint()) {
+								ret->itemStatus[sent[item]] = static_cast<unsigned short>(idx["status"].GetUint());
+							}
+						}
+					}
 					
 					// Error handling
 					// ret->error should also be enabled if error is set to true in the 'response'
@@ -554,7 +1042,7 @@ namespace beat {
 								bool first = true;
 								for (SizeType item_size = 0; item_size < items.Size(); item_size++) {
 									stringstream ss2;
-									const Value & idx = items[item_size]["index"];
+									const Value & idx = items[item_size][op];
 									if (!idx.IsObject()) {
 										continue;
 									}
@@ -616,7 +1104,7 @@ namespace beat {
 								return ret;
 							}
 							for (SizeType item_size = 0; item_size < items.Size(); item_size++) {
-								const Value & idx = items[item_size]["index"];
+								const Value & idx = items[item_size][op];
 								if (!idx.IsObject()) {
 									continue;
 								}
@@ -629,9 +1117,9 @@ namespace beat {
 					} else if (response.HasMember("error")) {
 						const Value & err = response["error"];
 						if (!err.IsObject()) {
-							ss << "Cannot parse 'error' field. Capture elasticsearch traffic using tcpdump and report it"; 
+							ret->error = "Cannot parse 'error' field. Capture elasticsearch traffic using tcpdump and report it";
 						} else {
-							ss << err["type"].GetString() << ": " << err["reason"].GetString();
+							ret->error = string(err["type"].GetString()) + ": " + err["reason"].GetString();
 						}
 						if (response.HasMember("status")) {
 							ret->httpStatus = (unsigned short int)response["status"].GetUint();
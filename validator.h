@@ -0,0 +1,609 @@
+/*
+ *   Copyright 2017 Thomas d'Otreppe de Bouvette <tdotreppe@aircrack-ng.org>
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+
+ *       http://www.apache.org/licenses/LICENSE-2.0
+
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+#ifndef ELASTICBEAT_CPP_VALIDATOR_H
+#define ELASTICBEAT_CPP_VALIDATOR_H
+
+#include <string>
+#include <string.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using std::string;
+
+#define _EB_VALIDATOR_MAX_DEPTH 64
+#define _EB_VALIDATOR_BLOCK_SIZE 64
+#define _EB_VALIDATOR_TIMESTAMP_KEY "\"@timestamp\""
+#define _EB_VALIDATOR_TIMESTAMP_KEY_LEN 12
+
+namespace beat {
+	// Validates a JSON document (including UTF-8), strips insignificant whitespace and
+	// picks up the top-level @timestamp in a single pass.
+	//
+	// Works in two stages, one 64-byte block at a time:
+	// 1. Classification (AVX2, SSE2 or scalar): bitmasks of quotes, backslashes,
+	//    whitespace and structural characters. Escapes and string boundaries are
+	//    resolved with bit operations (prefix XOR of the quotes), then whitespace
+	//    outside strings is dropped by copying the runs of kept bytes.
+	// 2. Grammar: only the positions of structural characters, opening quotes and
+	//    the start of numbers/literals are visited, through the bitmask.
+	class validator {
+		private:
+			struct BlockMasks {
+				uint64_t quote;
+				uint64_t backslash;
+				uint64_t whitespace;
+				uint64_t structural;
+				uint64_t control;
+				uint64_t nonASCII;
+			};
+
+			enum TokenClass {
+				OpenObject,
+				OpenArray,
+				CloseObject,
+				CloseArray,
+				Colon,
+				Comma,
+				String,
+				Scalar,		// Number or literal
+				TokenClassCount
+			};
+
+			enum State {
+				ObjectKeyOrClose,
+				ObjectKey,
+				ObjectColon,
+				ObjectValue,
+				ObjectCommaOrClose,
+				ArrayValueOrClose,
+				ArrayValue,
+				ArrayCommaOrClose,
+				Start,
+				End,
+				Error,
+				Pop,		// Transition only: next state depends on the parent container
+				StateCount = Pop
+			};
+
+			// Stage 2 lookup tables. The transitions of each token class are packed
+			// in one word, 4 bits per state, so the next state is a shift away from
+			// the current one instead of a dependent load.
+			struct Tables {
+				unsigned char classes[256];
+				uint64_t transitions[TokenClassCount];
+				Tables()
+				{
+					static const unsigned char table[StateCount][TokenClassCount] = {
+						//                     {                 [                  }      ]      :            ,           String              Scalar
+						/* ObjectKeyOrClose */   { Error,            Error,             Pop,   Error, Error,       Error,      ObjectColon,        Error },
+						/* ObjectKey */          { Error,            Error,             Error, Error, Error,       Error,      ObjectColon,        Error },
+						/* ObjectColon */        { Error,            Error,             Error, Error, ObjectValue, Error,      Error,              Error },
+						/* ObjectValue */        { ObjectKeyOrClose, ArrayValueOrClose, Error, Error, Error,       Error,      ObjectCommaOrClose, ObjectCommaOrClose },
+						/* ObjectCommaOrClose */ { Error,            Error,             Pop,   Error, Error,       ObjectKey,  Error,              Error },
+						/* ArrayValueOrClose */  { ObjectKeyOrClose, ArrayValueOrClose, Error, Pop,   Error,       Error,      ArrayCommaOrClose,  ArrayCommaOrClose },
+						/* ArrayValue */         { ObjectKeyOrClose, ArrayValueOrClose, Error, Error, Error,       Error,      ArrayCommaOrClose,  ArrayCommaOrClose },
+						/* ArrayCommaOrClose */  { Error,            Error,             Error, Pop,   Error,       ArrayValue, Error,              Error },
+						/* Start */              { ObjectKeyOrClose, Error,             Error, Error, Error,       Error,      Error,              Error },
+						/* End */                { Error,            Error,             Error, Error, Error,       Error,      Error,              Error },
+						/* Error */              { Error,            Error,             Error, Error, Error,       Error,      Error,              Error }
+					};
+
+					memset(classes, Scalar, sizeof(classes));
+					classes[static_cast<unsigned char>('{')] = OpenObject;
+					classes[static_cast<unsigned char>('[')] = OpenArray;
+					classes[static_cast<unsigned char>('}')] = CloseObject;
+					classes[static_cast<unsigned char>(']')] = CloseArray;
+					classes[static_cast<unsigned char>(':')] = Colon;
+					classes[static_cast<unsigned char>(',')] = Comma;
+					classes[static_cast<unsigned char>('"')] = String;
+
+					for (unsigned int cls = 0; cls < TokenClassCount; ++cls) {
+						transitions[cls] = 0;
+						for (unsigned int state = 0; state < StateCount; ++state) {
+							transitions[cls] |= static_cast<uint64_t>(table[state][cls]) << (state * 4);
+						}
+					}
+				}
+			};
+
+			// Stage 2 state, copied to locals for each block so it stays in registers
+			struct Grammar {
+				unsigned int state;
+				unsigned int depth;
+				uint64_t objects; // One bit per nesting level, set for objects
+				bool timestampNext;
+			};
+
+			const char * _in;
+			size_t _len;
+			string & _timestamp;
+
+			// Carried from one block to the next
+			uint64_t _prevInString;
+			uint64_t _prevEscaped;
+			uint64_t _prevScalar;
+			size_t _utf8Done;
+
+			Grammar _grammar;
+
+			validator(const string & in, string & timestamp) : _in(in.data()), _len(in.size()), _timestamp(timestamp),
+				_prevInString(0), _prevEscaped(0), _prevScalar(0), _utf8Done(0)
+			{
+				this->_grammar.state = Start;
+				this->_grammar.depth = 0;
+				this->_grammar.objects = 0;
+				this->_grammar.timestampNext = false;
+			}
+
+			static inline unsigned int ctz(uint64_t x)
+			{
+				return static_cast<unsigned int>(__builtin_ctzll(x));
+			}
+
+			static inline uint64_t prefixXor(uint64_t x)
+			{
+				x ^= x << 1;
+				x ^= x << 2;
+				x ^= x << 4;
+				x ^= x << 8;
+				x ^= x << 16;
+				x ^= x << 32;
+				return x;
+			}
+
+			static void classify(const char * p, BlockMasks & m)
+			{
+#if defined(__AVX2__)
+				m.quote = m.backslash = m.whitespace = m.structural = m.control = m.nonASCII = 0;
+				for (int i = 0; i < 2; ++i) {
+					__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i * 32));
+					// Setting 0x20 maps '[' to '{' and ']' to '}'
+					__m256i lower = _mm256_or_si256(x, _mm256_set1_epi8(0x20));
+					__m256i ws = _mm256_or_si256(
+							_mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n'))),
+							_mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('\r')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\t'))));
+					__m256i st = _mm256_or_si256(
+							_mm256_or_si256(_mm256_cmpeq_epi8(lower, _mm256_set1_epi8('{')), _mm256_cmpeq_epi8(lower, _mm256_set1_epi8('}'))),
+							_mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(':')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8(','))));
+					int shift = i * 32;
+					uint64_t high = static_cast<uint32_t>(_mm256_movemask_epi8(x));
+					// Signed compare: also true for bytes >= 0x80, removed below
+					uint64_t belowSpace = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), x)));
+					m.quote |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('"'))))) << shift;
+					m.backslash |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('\\'))))) << shift;
+					m.whitespace |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(ws))) << shift;
+					m.structural |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(st))) << shift;
+					m.control |= (belowSpace & ~high) << shift;
+					m.nonASCII |= high << shift;
+				}
+#elif defined(__SSE2__)
+				m.quote = m.backslash = m.whitespace = m.structural = m.control = m.nonASCII = 0;
+				for (int i = 0; i < 4; ++i) {
+					__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i * 16));
+					__m128i lower = _mm_or_si128(x, _mm_set1_epi8(0x20));
+					__m128i ws = _mm_or_si128(
+							_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(x, _mm_set1_epi8('\n'))),
+							_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(x, _mm_set1_epi8('\t'))));
+					__m128i st = _mm_or_si128(
+							_mm_or_si128(_mm_cmpeq_epi8(lower, _mm_set1_epi8('{')), _mm_cmpeq_epi8(lower, _mm_set1_epi8('}'))),
+							_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(':')), _mm_cmpeq_epi8(x, _mm_set1_epi8(','))));
+					int shift = i * 16;
+					uint64_t high = static_cast<unsigned int>(_mm_movemask_epi8(x));
+					uint64_t belowSpace = static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmplt_epi8(x, _mm_set1_epi8(0x20))));
+					m.quote |= static_cast<uint64_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8('"')))) << shift;
+					m.backslash |= static_cast<uint64_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8('\\')))) << shift;
+					m.whitespace |= static_cast<uint64_t>(_mm_movemask_epi8(ws)) << shift;
+					m.structural |= static_cast<uint64_t>(_mm_movemask_epi8(st)) << shift;
+					m.control |= (belowSpace & ~high) << shift;
+					m.nonASCII |= high << shift;
+				}
+#else
+				m.quote = m.backslash = m.whitespace = m.structural = m.control = m.nonASCII = 0;
+				for (int i = 0; i < _EB_VALIDATOR_BLOCK_SIZE; ++i) {
+					unsigned char c = static_cast<unsigned char>(p[i]);
+					uint64_t bit = 1ULL << i;
+					switch (c) {
+						case '"':
+							m.quote |= bit;
+							break;
+						case '\\':
+							m.backslash |= bit;
+							break;
+						case ' ':
+						case '\n':
+						case '\r':
+						case '\t':
+							m.whitespace |= bit;
+							break;
+						case '{':
+						case '}':
+						case '[':
+						case ']':
+						case ':':
+						case ',':
+							m.structural |= bit;
+							break;
+						default:
+							break;
+					}
+					if (c < 0x20) {
+						m.control |= bit;
+					} else if (c >= 0x80) {
+						m.nonASCII |= bit;
+					}
+				}
+#endif
+			}
+
+			static inline bool isDelimiter(char c)
+			{
+				switch (c) {
+					case ' ':
+					case '\n':
+					case '\r':
+					case '\t':
+					case '{':
+					case '}':
+					case '[':
+					case ']':
+					case ':':
+					case ',':
+					case '"':
+						return true;
+					default:
+						return false;
+				}
+			}
+
+			// pos is the backslash
+			bool isValidEscape(size_t pos)
+			{
+				if (pos + 1 >= this->_len) {
+					return false;
+				}
+				switch (this->_in[pos + 1]) {
+					case '"':
+					case '\\':
+					case '/':
+					case 'b':
+					case 'f':
+					case 'n':
+					case 'r':
+					case 't':
+						return true;
+					case 'u':
+						if (pos + 5 >= this->_len) {
+							return false;
+						}
+						for (size_t i = pos + 2; i < pos + 6; ++i) {
+							if (!isxdigit(static_cast<unsigned char>(this->_in[i]))) {
+								return false;
+							}
+						}
+						return true;
+					default:
+						return false;
+				}
+			}
+
+			inline bool isContinuation(size_t pos, unsigned char low = 0x80, unsigned char high = 0xBF)
+			{
+				if (pos >= this->_len) {
+					return false;
+				}
+				unsigned char c = static_cast<unsigned char>(this->_in[pos]);
+				return c >= low && c <= high;
+			}
+
+			// Validates the run of multi-byte UTF-8 sequences starting at pos
+			// (RFC 3629: no overlongs, no surrogates, max U+10FFFF)
+			bool validateUTF8(size_t pos)
+			{
+				while (pos < this->_len && static_cast<unsigned char>(this->_in[pos]) >= 0x80) {
+					unsigned char c = static_cast<unsigned char>(this->_in[pos]);
+					size_t len;
+					bool valid;
+					if (c >= 0xC2 && c <= 0xDF) {
+						len = 2;
+						valid = isContinuation(pos + 1);
+					} else if (c == 0xE0) {
+						len = 3;
+						valid = isContinuation(pos + 1, 0xA0, 0xBF) && isContinuation(pos + 2);
+					} else if (c == 0xED) {
+						len = 3;
+						valid = isContinuation(pos + 1, 0x80, 0x9F) && isContinuation(pos + 2);
+					} else if (c >= 0xE1 && c <= 0xEF) {
+						len = 3;
+						valid = isContinuation(pos + 1) && isContinuation(pos + 2);
+					} else if (c == 0xF0) {
+						len = 4;
+						valid = isContinuation(pos + 1, 0x90, 0xBF) && isContinuation(pos + 2) && isContinuation(pos + 3);
+					} else if (c >= 0xF1 && c <= 0xF3) {
+						len = 4;
+						valid = isContinuation(pos + 1) && isContinuation(pos + 2) && isContinuation(pos + 3);
+					} else if (c == 0xF4) {
+						len = 4;
+						valid = isContinuation(pos + 1, 0x80, 0x8F) && isContinuation(pos + 2) && isContinuation(pos + 3);
+					} else {
+						return false;
+					}
+
+					if (!valid) {
+						return false;
+					}
+					pos += len;
+				}
+				this->_utf8Done = pos;
+				return true;
+			}
+
+			inline const char * skipDigits(const char * p, const char * end)
+			{
+				while (p < end && *p >= '0' && *p <= '9') {
+					++p;
+				}
+				return p;
+			}
+
+			// Number or literal starting at pos
+			bool validateScalar(size_t pos)
+			{
+				const char * p = this->_in + pos;
+				const char * end = this->_in + this->_len;
+				const char * q;
+
+				switch (*p) {
+					case 't':
+						q = (end - p >= 4 && memcmp(p, "true", 4) == 0) ? p + 4 : NULL;
+						break;
+					case 'f':
+						q = (end - p >= 5 && memcmp(p, "false", 5) == 0) ? p + 5 : NULL;
+						break;
+					case 'n':
+						q = (end - p >= 4 && memcmp(p, "null", 4) == 0) ? p + 4 : NULL;
+						break;
+					default:
+						q = p;
+						if (*q == '-') {
+							++q;
+						}
+						if (q < end && *q == '0') {
+							++q;
+						} else {
+							const char * digits = q;
+							q = skipDigits(q, end);
+							if (q == digits) {
+								return false;
+							}
+						}
+						if (q < end && *q == '.') {
+							const char * digits = ++q;
+							q = skipDigits(q, end);
+							if (q == digits) {
+								return false;
+							}
+						}
+						if (q < end && (*q == 'e' || *q == 'E')) {
+							++q;
+							if (q < end && (*q == '+' || *q == '-')) {
+								++q;
+							}
+							const char * digits = q;
+							q = skipDigits(q, end);
+							if (q == digits) {
+								return false;
+							}
+						}
+						break;
+				}
+
+				return q != NULL && (q == end || isDelimiter(*q));
+			}
+
+			void extractTimestamp(size_t pos)
+			{
+				// Raw content, without the quotes
+				size_t end = pos + 1;
+				while (end < this->_len && this->_in[end] != '"') {
+					end += (this->_in[end] == '\\') ? 2 : 1;
+				}
+				if (end < this->_len) {
+					this->_timestamp.assign(this->_in + pos + 1, end - pos - 1);
+				}
+			}
+
+			// Stage 2: grammar as a transition table, so the only data dependent
+			// branches are for numbers/literals and the @timestamp key.
+			bool visitTokens(uint64_t tokens, size_t start)
+			{
+				static const Tables tables;
+
+				Grammar g = this->_grammar;
+				bool ret = true;
+				for (; tokens; tokens &= tokens - 1) {
+					size_t pos = start + ctz(tokens);
+					unsigned int cls = tables.classes[static_cast<unsigned char>(this->_in[pos])];
+
+					if (cls == Scalar) {
+						ret &= validateScalar(pos);
+					} else if (cls == String && this->_in[pos + 1] == '@') {
+						// _in[_len] is the terminating 0 of the string, no overflow
+						if (g.timestampNext && g.state == ObjectValue) {
+							extractTimestamp(pos);
+						}
+						g.timestampNext = g.depth == 1 && (g.state == ObjectKeyOrClose || g.state == ObjectKey)
+							&& this->_len - pos >= _EB_VALIDATOR_TIMESTAMP_KEY_LEN
+							&& memcmp(this->_in + pos, _EB_VALIDATOR_TIMESTAMP_KEY, _EB_VALIDATOR_TIMESTAMP_KEY_LEN) == 0;
+						if (g.timestampNext) {
+							g.state = ObjectColon;
+							continue;
+						}
+					}
+					if (g.timestampNext && g.state == ObjectValue) {
+						if (cls == String) {
+							extractTimestamp(pos);
+						}
+						g.timestampNext = false;
+					}
+
+					// Container state to return to if this token closes one, computed
+					// off the state dependency chain
+					bool push = (cls == OpenObject || cls == OpenArray);
+					bool close = (cls == CloseObject || cls == CloseArray);
+					State parent = (g.depth <= 1) ? End : (((g.objects >> 1) & 1) ? ObjectCommaOrClose : ArrayCommaOrClose);
+
+					unsigned int next = (tables.transitions[cls] >> (g.state * 4)) & 0xF;
+					g.state = (next == Pop) ? static_cast<unsigned int>(parent) : next;
+
+					g.depth += push;
+					g.depth -= close;
+					g.objects = push ? ((g.objects << 1) | (cls == OpenObject)) : (close ? (g.objects >> 1) : g.objects);
+					ret &= (g.depth <= _EB_VALIDATOR_MAX_DEPTH);
+				}
+
+				this->_grammar = g;
+				return ret && g.state != Error;
+			}
+
+			// Stage 1 and 2 for one block, kept bytes are copied to dst
+			bool processBlock(const char * p, size_t start, uint64_t valid, char * & dst)
+			{
+				BlockMasks m;
+				classify(p, m);
+
+				// Characters escaped by a backslash. Backslashes are rare in beat
+				// documents so a loop is cheaper than the branchless version.
+				uint64_t escaped = this->_prevEscaped;
+				uint64_t escapers = 0;
+				uint64_t backslash = m.backslash & ~this->_prevEscaped & valid;
+				this->_prevEscaped = 0;
+				while (backslash) {
+					unsigned int i = ctz(backslash);
+					escapers |= 1ULL << i;
+					if (i == 63) {
+						this->_prevEscaped = 1;
+						break;
+					}
+					escaped |= 1ULL << (i + 1);
+					backslash &= ~(3ULL << i);
+				}
+
+				// In-string mask: opening quote and content, not the closing quote
+				uint64_t quote = m.quote & ~escaped & valid;
+				uint64_t inString = prefixXor(quote) ^ this->_prevInString;
+				this->_prevInString = static_cast<uint64_t>(static_cast<int64_t>(inString) >> 63);
+
+				// Raw control characters (embedded newlines) would break the bulk body
+				if (m.control & inString & valid) {
+					return false;
+				}
+
+				for (uint64_t check = escapers & inString; check; check &= check - 1) {
+					if (!isValidEscape(start + ctz(check))) {
+						return false;
+					}
+				}
+
+				// Skip bytes already covered by a sequence from the previous block
+				uint64_t nonASCII = m.nonASCII & valid;
+				while (nonASCII) {
+					if (this->_utf8Done > start) {
+						size_t done = this->_utf8Done - start;
+						nonASCII &= (done >= 64) ? 0 : (~0ULL << done);
+						if (!nonASCII) {
+							break;
+						}
+					}
+					if (!validateUTF8(start + ctz(nonASCII))) {
+						return false;
+					}
+				}
+
+				uint64_t structural = m.structural & ~inString;
+				uint64_t scalar = ~(m.whitespace | m.structural | quote) & ~inString & valid;
+				uint64_t scalarStarts = scalar & ~((scalar << 1) | this->_prevScalar);
+				this->_prevScalar = scalar >> 63;
+
+				if (!visitTokens(structural | (quote & inString) | scalarStarts, start)) {
+					return false;
+				}
+
+				// Minify: copy the runs of bytes that aren't whitespace outside strings
+				uint64_t keep = ~(m.whitespace & ~inString) & valid;
+				if (keep == ~0ULL) {
+					memcpy(dst, p, _EB_VALIDATOR_BLOCK_SIZE);
+					dst += _EB_VALIDATOR_BLOCK_SIZE;
+					return true;
+				}
+				while (keep) {
+					unsigned int first = ctz(keep);
+					uint64_t rest = ~(keep >> first);
+					unsigned int len = (rest == 0) ? 64 - first : ctz(rest);
+					memcpy(dst, p + first, len);
+					dst += len;
+					if (first + len >= 64) {
+						break;
+					}
+					keep &= ~0ULL << (first + len);
+				}
+				return true;
+			}
+
+		public:
+			// Validates 'in' (must be a JSON object), appends its minified version to 'out'
+			// and sets 'timestamp' to the top-level @timestamp string if present.
+			// On failure, 'out' is left as it was.
+			static bool minify(const string & in, string & out, string & timestamp)
+			{
+				size_t mark = out.size();
+				out.resize(mark + in.size());
+				char * dst = &out[0] + mark;
+				timestamp.clear();
+
+				validator v(in, timestamp);
+				bool ret = true;
+				size_t pos = 0;
+				for (; ret && pos + _EB_VALIDATOR_BLOCK_SIZE <= in.size(); pos += _EB_VALIDATOR_BLOCK_SIZE) {
+					ret = v.processBlock(in.data() + pos, pos, ~0ULL, dst);
+				}
+				if (ret && pos < in.size()) {
+					// Last block, padded with whitespace
+					char block[_EB_VALIDATOR_BLOCK_SIZE];
+					memset(block, ' ', sizeof(block));
+					memcpy(block, in.data() + pos, in.size() - pos);
+					ret = v.processBlock(block, pos, (1ULL << (in.size() - pos)) - 1, dst);
+				}
+				ret = ret && v._grammar.state == End && v._prevInString == 0;
+
+				if (ret) {
+					out.resize(dst - out.data());
+				} else {
+					out.resize(mark);
+					timestamp.clear();
+				}
+				return ret;
+			}
+	};
+}
+
+#endif // ELASTICBEAT_CPP_VALIDATOR_H